@@ -4,6 +4,7 @@
 #include <X11/cursorfont.h>
 #include <X11/XKBlib.h>
 #include <X11/Xatom.h>
+#include <X11/extensions/XShm.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,11 +14,25 @@
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include <png.h>
 
 #define MAX_WINDOWS 64
 #define MAX_WORKSPACES 9
 #define MAX_KEYBINDS 100
 #define MAX_AUTOSTART 32
+#define MAX_SCRATCHPADS 8
+#define MAX_RULES 64
+#define RULE_HASH_SIZE 64
+#define MAX_WINDOW_TYPES 8
 #define CONFIG_FILE "~/.config/twm/twm.conf"
 
 typedef struct {
@@ -33,8 +48,42 @@ typedef struct {
     int x, y, width, height;
     int workspace;
     int managed;
+    int scratchpad;
 } WindowState;
 
+/* A [Rules] entry. NULL/None match fields match anything; class, instance
+ * and title may be fnmatch(3) patterns. */
+typedef struct {
+    char *class_name;
+    char *instance;
+    char *title;
+    Atom type;
+    int workspace;
+    int floating;
+    int fullscreen;
+    int has_geometry;
+    int x, y, width, height;
+    int x_negative, y_negative;
+    int hash_on_class;
+    int next;
+} Rule;
+
+typedef struct {
+    int width, height;
+    unsigned char *pixels;
+} RGBImage;
+
+typedef struct {
+    char magic[8];
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t source_size;
+    uint32_t width, height;
+    uint32_t red_mask, green_mask, blue_mask;
+    uint32_t source_hash;
+    uint32_t background_color;
+} WallpaperCacheHeader;
+
 Display *display;
 Window root;
 Window windows[MAX_WINDOWS];
@@ -59,6 +108,7 @@ unsigned long background_color = 0x000000;
 unsigned long border_color = 0x444444;
 unsigned long border_focus_color = 0x0000FF;
 char *wallpaper_path = NULL;
+int shm_attach_failed = 0;
 
 const int gap_inner = 8;
 const int gap_outer = 16;
@@ -68,17 +118,59 @@ Atom net_number_of_desktops;
 Atom net_current_desktop;
 Atom net_wm_desktop;
 Atom net_desktop_names;
+Atom xrootpmap_id;
+Atom esetroot_pmap_id;
+Atom twm_wallpaper_pmap;
+Atom net_wm_pid;
+Atom net_wm_window_type;
+Atom wm_protocols;
+Atom wm_delete_window;
 
 Keybind *keybinds = NULL;
 int keybind_count = 0;
 char *autostart_commands[MAX_AUTOSTART];
 int autostart_count = 0;
 
+/* Scratchpad windows: SCRATCHPAD_POOLED ones were launched ahead of time and
+ * are held unmapped on workspace 0 until summoned; SCRATCHPAD_IN_USE ones
+ * have been shown at least once and are parked offscreen when hidden. */
+enum { SCRATCHPAD_NONE, SCRATCHPAD_POOLED, SCRATCHPAD_IN_USE };
+
+/* Pool windows are recognised by _NET_WM_PID, which only works when the
+ * command execs the terminal itself. For launchers that hand off to another
+ * process (gnome-terminal, kitty --single-instance) set class= to the
+ * window's WM_CLASS class or instance; a launcher that exits cleanly is then
+ * counted in scratchpad_handed_off until a window of that class shows up. */
+char *scratchpad_command = NULL;
+char *scratchpad_class = NULL;
+int scratchpad_pool_size = 1;
+int scratchpad_width = 0;
+int scratchpad_height = 0;
+pid_t scratchpad_pending[MAX_SCRATCHPADS];
+int scratchpad_pending_count = 0;
+int scratchpad_handed_off = 0;
+int scratchpad_failed = 0;
+Window scratchpad_focus_pending = None;
+
+/* Rules with an exact class or instance are chained in rule_hash under that
+ * name; the rest are tried for every window from rule_fallback. */
+Rule rules[MAX_RULES];
+int rule_count = 0;
+int rule_hash[RULE_HASH_SIZE];
+int rule_fallback[MAX_RULES];
+int rule_fallback_count = 0;
+int rules_need_title = 0;
+int rules_need_type = 0;
+
 char **saved_argv;
 int saved_argc;
 
 time_t last_bar_update = 0;
 
+int xkb_event_base = -1;
+int xkb_group = 0;
+char xkb_group_labels[XkbNumKbdGroups][8];
+
 void trim(char *str) {
     char *end = str + strlen(str) - 1;
     while (end > str && isspace(*end)) end--;
@@ -87,6 +179,120 @@ void trim(char *str) {
     memmove(str, str, strlen(str) + 1);
 }
 
+uint32_t hash_string(const char *str) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = str; *c; c++) hash = (hash ^ (unsigned char)*c) * 16777619u;
+    return hash;
+}
+
+int is_pattern(const char *str) {
+    return strpbrk(str, "*?[") != NULL;
+}
+
+Atom parse_window_type(const char *name) {
+    static const char *known[] = {
+        "DESKTOP", "DOCK", "TOOLBAR", "MENU", "UTILITY", "SPLASH", "DIALOG",
+        "DROPDOWN_MENU", "POPUP_MENU", "TOOLTIP", "NOTIFICATION", "COMBO",
+        "DND", "NORMAL", NULL
+    };
+    const char *prefix = "_NET_WM_WINDOW_TYPE_";
+    char atom_name[64];
+    int n = snprintf(atom_name, sizeof atom_name, "%s%s", prefix, name);
+    if (n < 0 || n >= (int)sizeof atom_name) return None;
+    for (char *c = atom_name; *c; c++) *c = toupper((unsigned char)*c);
+    for (int i = 0; known[i]; i++)
+        if (strcmp(atom_name + strlen(prefix), known[i]) == 0)
+            return XInternAtom(display, atom_name, False);
+    return None;
+}
+
+/* Parses "class:Firefox,title:*Mozilla*" = "workspace:2 float geometry:800x600+0+0". */
+void parse_rule(char *match, char *actions) {
+    if (rule_count >= MAX_RULES) return;
+    Rule rule;
+    memset(&rule, 0, sizeof rule);
+    rule.type = None;
+    int has_match = 0;
+    for (char *tok = strtok(match, ","); tok; tok = strtok(NULL, ",")) {
+        while (isspace((unsigned char)*tok)) tok++;
+        trim(tok);
+        char *colon = strchr(tok, ':');
+        if (!colon) continue;
+        *colon = '\0';
+        char *what = colon + 1;
+        if (strcmp(tok, "class") == 0) {
+            rule.class_name = strdup(what);
+        } else if (strcmp(tok, "instance") == 0) {
+            rule.instance = strdup(what);
+        } else if (strcmp(tok, "title") == 0) {
+            rule.title = strdup(what);
+            rules_need_title = 1;
+        } else if (strcmp(tok, "type") == 0) {
+            /* Unknown (e.g. misspelled) types would never match; drop the rule. */
+            rule.type = parse_window_type(what);
+            if (rule.type == None) {
+                has_match = 0;
+                break;
+            }
+            rules_need_type = 1;
+        } else {
+            continue;
+        }
+        has_match = 1;
+    }
+    for (char *tok = strtok(actions, " \t"); tok; tok = strtok(NULL, " \t")) {
+        if (strncmp(tok, "workspace:", 10) == 0) {
+            int ws = atoi(tok + 10);
+            if (ws >= 1 && ws <= MAX_WORKSPACES) rule.workspace = ws;
+        } else if (strcmp(tok, "float") == 0) {
+            rule.floating = 1;
+        } else if (strcmp(tok, "fullscreen") == 0) {
+            rule.fullscreen = 1;
+        } else if (strncmp(tok, "geometry:", 9) == 0) {
+            unsigned int w, h;
+            int flags = XParseGeometry(tok + 9, &rule.x, &rule.y, &w, &h);
+            if ((flags & WidthValue) && (flags & HeightValue) && w > 0 && h > 0) {
+                rule.has_geometry = 1;
+                rule.floating = 1;
+                rule.width = w;
+                rule.height = h;
+                rule.x_negative = (flags & XNegative) != 0;
+                rule.y_negative = (flags & YNegative) != 0;
+            }
+        }
+    }
+    if (!has_match) {
+        free(rule.class_name);
+        free(rule.instance);
+        free(rule.title);
+        return;
+    }
+    rules[rule_count++] = rule;
+}
+
+void compile_rules() {
+    for (int i = 0; i < RULE_HASH_SIZE; i++) rule_hash[i] = -1;
+    rule_fallback_count = 0;
+    for (int i = 0; i < rule_count; i++) {
+        Rule *rule = &rules[i];
+        const char *key = NULL;
+        if (rule->class_name && !is_pattern(rule->class_name)) {
+            key = rule->class_name;
+            rule->hash_on_class = 1;
+        } else if (rule->instance && !is_pattern(rule->instance)) {
+            key = rule->instance;
+            rule->hash_on_class = 0;
+        }
+        if (key) {
+            uint32_t h = hash_string(key) % RULE_HASH_SIZE;
+            rule->next = rule_hash[h];
+            rule_hash[h] = i;
+        } else {
+            rule_fallback[rule_fallback_count++] = i;
+        }
+    }
+}
+
 unsigned int parse_modifier(const char *mod_str) {
     unsigned int mod = 0;
     if (strstr(mod_str, "Mod4")) mod |= Mod4Mask;
@@ -162,6 +368,22 @@ void load_config() {
                     keybind_count++;
                 }
             }
+        } else if (strcmp(section, "Scratchpad") == 0) {
+            if (strcmp(key, "command") == 0) {
+                scratchpad_command = strdup(value);
+            } else if (strcmp(key, "class") == 0) {
+                scratchpad_class = strdup(value);
+            } else if (strcmp(key, "pool") == 0) {
+                scratchpad_pool_size = atoi(value);
+                if (scratchpad_pool_size < 0) scratchpad_pool_size = 0;
+                if (scratchpad_pool_size > MAX_SCRATCHPADS) scratchpad_pool_size = MAX_SCRATCHPADS;
+            } else if (strcmp(key, "width") == 0) {
+                scratchpad_width = atoi(value);
+            } else if (strcmp(key, "height") == 0) {
+                scratchpad_height = atoi(value);
+            }
+        } else if (strcmp(section, "Rules") == 0) {
+            parse_rule(key, value);
         } else if (strcmp(section, "Autostart") == 0 && autostart_count < MAX_AUTOSTART) {
             autostart_commands[autostart_count] = strdup(value);
             autostart_count++;
@@ -169,6 +391,7 @@ void load_config() {
     }
 
     fclose(f);
+    compile_rules();
 }
 
 void apply_window_border(Window w, Bool is_focused) {
@@ -176,11 +399,419 @@ void apply_window_border(Window w, Bool is_focused) {
     XSetWindowBorder(display, w, is_focused ? border_focus_color : border_color);
 }
 
+int decode_farbfeld(const unsigned char *data, size_t size, RGBImage *img) {
+    if (size < 16 || memcmp(data, "farbfeld", 8) != 0) return 0;
+    uint32_t w = (uint32_t)data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11];
+    uint32_t h = (uint32_t)data[12] << 24 | data[13] << 16 | data[14] << 8 | data[15];
+    if (w == 0 || h == 0 || w > 32768 || h > 32768 || (uint64_t)w * h * 8 > size - 16) return 0;
+    img->pixels = malloc((size_t)w * h * 3);
+    if (!img->pixels) return 0;
+    img->width = w;
+    img->height = h;
+    unsigned bg[3] = { background_color >> 16 & 0xFF, background_color >> 8 & 0xFF, background_color & 0xFF };
+    const unsigned char *src = data + 16;
+    unsigned char *dst = img->pixels;
+    for (size_t i = 0; i < (size_t)w * h; i++, src += 8, dst += 3) {
+        unsigned a = src[6] << 8 | src[7];
+        for (int c = 0; c < 3; c++) {
+            unsigned v = src[c * 2] << 8 | src[c * 2 + 1];
+            dst[c] = (unsigned char)((((uint64_t)v * a + (uint64_t)(bg[c] * 257) * (65535 - a)) / 65535) >> 8);
+        }
+    }
+    return 1;
+}
+
+const unsigned char *ppm_next_field(const unsigned char *p, const unsigned char *end, unsigned *out) {
+    while (p < end) {
+        if (*p == '#') {
+            while (p < end && *p != '\n') p++;
+        } else if (isspace(*p)) {
+            p++;
+        } else {
+            break;
+        }
+    }
+    if (p >= end || !isdigit(*p)) return NULL;
+    unsigned v = 0;
+    while (p < end && isdigit(*p) && v < 100000) v = v * 10 + (*p++ - '0');
+    *out = v;
+    return p;
+}
+
+int decode_ppm(const unsigned char *data, size_t size, RGBImage *img) {
+    if (size < 2 || data[0] != 'P' || data[1] != '6') return 0;
+    const unsigned char *end = data + size;
+    unsigned w, h, maxval;
+    const unsigned char *p = data + 2;
+    if (!(p = ppm_next_field(p, end, &w)) || !(p = ppm_next_field(p, end, &h)) ||
+        !(p = ppm_next_field(p, end, &maxval)))
+        return 0;
+    if (p >= end || !isspace(*p)) return 0;
+    p++;
+    int bps = maxval > 255 ? 2 : 1;
+    if (w == 0 || h == 0 || w > 32768 || h > 32768 || maxval == 0 || maxval > 65535 ||
+        (uint64_t)w * h * 3 * bps > (uint64_t)(end - p))
+        return 0;
+    img->pixels = malloc((size_t)w * h * 3);
+    if (!img->pixels) return 0;
+    img->width = w;
+    img->height = h;
+    for (size_t i = 0; i < (size_t)w * h * 3; i++) {
+        unsigned v = bps == 2 ? (unsigned)(p[i * 2] << 8 | p[i * 2 + 1]) : p[i];
+        img->pixels[i] = (unsigned char)(v * 255 / maxval);
+    }
+    return 1;
+}
+
+int decode_png(const unsigned char *data, size_t size, RGBImage *img) {
+    if (size < 8 || png_sig_cmp(data, 0, 8) != 0) return 0;
+    png_image image;
+    memset(&image, 0, sizeof image);
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&image, data, size)) return 0;
+    image.format = PNG_FORMAT_RGB;
+    img->pixels = malloc(PNG_IMAGE_SIZE(image));
+    if (!img->pixels) {
+        png_image_free(&image);
+        return 0;
+    }
+    png_color bg = { background_color >> 16 & 0xFF, background_color >> 8 & 0xFF, background_color & 0xFF };
+    if (!png_image_finish_read(&image, &bg, img->pixels, 0, NULL)) {
+        free(img->pixels);
+        img->pixels = NULL;
+        return 0;
+    }
+    img->width = image.width;
+    img->height = image.height;
+    return 1;
+}
+
+int load_image(const char *path, RGBImage *img) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    int ok = decode_farbfeld(data, st.st_size, img) ||
+             decode_ppm(data, st.st_size, img) ||
+             decode_png(data, st.st_size, img);
+    munmap(data, st.st_size);
+    return ok;
+}
+
+int mask_shift(unsigned long mask) {
+    int shift = 0;
+    while (mask && !(mask & 1)) {
+        mask >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+/* Scales the image to cover w x h (cropping the overflow, keeping the aspect
+ * ratio) with bilinear filtering, writing pixels in the visual's format. */
+int scale_image(const RGBImage *img, int w, int h, Visual *visual, uint32_t *out) {
+    double scale = (double)w / img->width;
+    if ((double)h / img->height > scale) scale = (double)h / img->height;
+    double ox = (img->width - w / scale) / 2;
+    double oy = (img->height - h / scale) / 2;
+    int rs = mask_shift(visual->red_mask) - (8 - __builtin_popcountl(visual->red_mask));
+    int gs = mask_shift(visual->green_mask) - (8 - __builtin_popcountl(visual->green_mask));
+    int bs = mask_shift(visual->blue_mask) - (8 - __builtin_popcountl(visual->blue_mask));
+
+    int *x0 = malloc(w * sizeof(int));
+    int *fx = malloc(w * sizeof(int));
+    if (!x0 || !fx) {
+        free(x0);
+        free(fx);
+        return 0;
+    }
+    for (int x = 0; x < w; x++) {
+        double sx = ox + (x + 0.5) / scale - 0.5;
+        if (sx < 0) sx = 0;
+        if (sx > img->width - 1) sx = img->width - 1;
+        x0[x] = (int)sx;
+        fx[x] = (int)((sx - x0[x]) * 256);
+    }
+    int stride = img->width * 3;
+    for (int y = 0; y < h; y++) {
+        double sy = oy + (y + 0.5) / scale - 0.5;
+        if (sy < 0) sy = 0;
+        if (sy > img->height - 1) sy = img->height - 1;
+        int y0 = (int)sy;
+        int fy = (int)((sy - y0) * 256);
+        const unsigned char *row0 = img->pixels + (size_t)y0 * stride;
+        const unsigned char *row1 = y0 + 1 < img->height ? row0 + stride : row0;
+        for (int x = 0; x < w; x++) {
+            int xa = x0[x] * 3;
+            int xb = x0[x] + 1 < img->width ? xa + 3 : xa;
+            unsigned c[3];
+            for (int k = 0; k < 3; k++) {
+                unsigned top = row0[xa + k] * (256 - fx[x]) + row0[xb + k] * fx[x];
+                unsigned bot = row1[xa + k] * (256 - fx[x]) + row1[xb + k] * fx[x];
+                c[k] = (top * (256 - fy) + bot * fy) >> 16;
+            }
+            uint32_t r = rs >= 0 ? c[0] << rs : c[0] >> -rs;
+            uint32_t g = gs >= 0 ? c[1] << gs : c[1] >> -gs;
+            uint32_t b = bs >= 0 ? c[2] << bs : c[2] >> -bs;
+            out[(size_t)y * w + x] = (r & visual->red_mask) | (g & visual->green_mask) | (b & visual->blue_mask);
+        }
+    }
+    free(x0);
+    free(fx);
+    return 1;
+}
+
+/* One cache file per resolution; the header says which source it holds, so
+ * switching wallpapers overwrites it instead of piling up old entries. */
+void wallpaper_cache_path(char *buf, size_t bufsz, int w, int h) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && xdg[0])
+        snprintf(buf, bufsz, "%s/twm/wallpaper-%dx%d", xdg, w, h);
+    else
+        snprintf(buf, bufsz, "%s/.cache/twm/wallpaper-%dx%d", getenv("HOME"), w, h);
+}
+
+WallpaperCacheHeader wallpaper_cache_header(const char *src, const struct stat *st, int w, int h,
+                                            Visual *visual) {
+    WallpaperCacheHeader hdr;
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, "twmwall3", 8);
+    hdr.source_hash = hash_string(src);
+    /* Transparent pixels are blended against it while decoding. */
+    hdr.background_color = background_color;
+    hdr.mtime_sec = st->st_mtim.tv_sec;
+    hdr.mtime_nsec = st->st_mtim.tv_nsec;
+    hdr.source_size = st->st_size;
+    hdr.width = w;
+    hdr.height = h;
+    hdr.red_mask = visual->red_mask;
+    hdr.green_mask = visual->green_mask;
+    hdr.blue_mask = visual->blue_mask;
+    return hdr;
+}
+
+/* Maps a cached pre-scaled wallpaper; the caller munmaps *map_size bytes at
+ * the returned header. */
+WallpaperCacheHeader *map_wallpaper_cache(const char *path, const WallpaperCacheHeader *want, size_t *map_size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    size_t size = sizeof(WallpaperCacheHeader) + (size_t)want->width * want->height * 4;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+        close(fd);
+        return NULL;
+    }
+    WallpaperCacheHeader *hdr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) return NULL;
+    if (memcmp(hdr, want, sizeof *want) != 0) {
+        munmap(hdr, size);
+        return NULL;
+    }
+    *map_size = size;
+    return hdr;
+}
+
+void write_wallpaper_cache(const char *path, const WallpaperCacheHeader *hdr, const uint32_t *pixels) {
+    char dir[512], tmp[576];
+    snprintf(dir, sizeof dir, "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (!slash) return;
+    *slash = '\0';
+    char *parent = strrchr(dir, '/');
+    if (parent) {
+        *parent = '\0';
+        mkdir(dir, 0755);
+        *parent = '/';
+    }
+    mkdir(dir, 0755);
+    snprintf(tmp, sizeof tmp, "%s.%d", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return;
+    size_t n = (size_t)hdr->width * hdr->height;
+    int ok = fwrite(hdr, sizeof *hdr, 1, f) == 1 && fwrite(pixels, 4, n, f) == n;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) unlink(tmp);
+}
+
+int shm_error_handler(Display *dpy, XErrorEvent *ee) {
+    shm_attach_failed = 1;
+    return 0;
+}
+
+Pixmap upload_wallpaper(Display *dpy, const uint32_t *pixels, int w, int h, Visual *visual, int depth) {
+    Pixmap pm = XCreatePixmap(dpy, DefaultRootWindow(dpy), w, h, depth);
+    GC gc = XCreateGC(dpy, pm, 0, NULL);
+    int uploaded = 0;
+
+    if (XShmQueryExtension(dpy)) {
+        XShmSegmentInfo shminfo;
+        XImage *img = XShmCreateImage(dpy, visual, depth, ZPixmap, NULL, &shminfo, w, h);
+        if (img && img->bits_per_pixel == 32) {
+            shminfo.shmid = shmget(IPC_PRIVATE, (size_t)img->bytes_per_line * h, IPC_CREAT | 0600);
+            if (shminfo.shmid >= 0) {
+                shminfo.shmaddr = img->data = shmat(shminfo.shmid, NULL, 0);
+                shminfo.readOnly = True;
+                if (shminfo.shmaddr != (char *)-1) {
+                    for (int y = 0; y < h; y++)
+                        memcpy(img->data + (size_t)y * img->bytes_per_line, pixels + (size_t)y * w, (size_t)w * 4);
+                    /* XShmAttach() can't report failure itself; a remote or
+                     * sandboxed server answers with BadAccess later. */
+                    XSync(dpy, False);
+                    shm_attach_failed = 0;
+                    XErrorHandler old_handler = XSetErrorHandler(shm_error_handler);
+                    XShmAttach(dpy, &shminfo);
+                    XSync(dpy, False);
+                    XSetErrorHandler(old_handler);
+                    if (!shm_attach_failed) {
+                        XShmPutImage(dpy, pm, gc, img, 0, 0, 0, 0, w, h, False);
+                        XSync(dpy, False);
+                        XShmDetach(dpy, &shminfo);
+                        uploaded = 1;
+                    }
+                    shmdt(shminfo.shmaddr);
+                }
+                shmctl(shminfo.shmid, IPC_RMID, NULL);
+            }
+        }
+        if (img) {
+            img->data = NULL;
+            XDestroyImage(img);
+        }
+    }
+    if (!uploaded) {
+        XImage *img = XCreateImage(dpy, visual, depth, ZPixmap, 0, (char *)pixels, w, h, 32, w * 4);
+        if (img && img->bits_per_pixel == 32) {
+            XPutImage(dpy, pm, gc, img, 0, 0, 0, 0, w, h);
+            uploaded = 1;
+        }
+        if (img) {
+            img->data = NULL;
+            XDestroyImage(img);
+        }
+    }
+    XFreeGC(dpy, gc);
+    if (!uploaded) {
+        XFreePixmap(dpy, pm);
+        return None;
+    }
+    return pm;
+}
+
+/* Frees the previous Esetroot-style wallpaper by killing the retained
+ * connection that owns it, as feh and hsetroot do. */
+Pixmap get_root_pixmap(Display *dpy, Window root_window, Atom property) {
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    unsigned char *data = NULL;
+    Pixmap pm = None;
+    if (XGetWindowProperty(dpy, root_window, property, 0, 1, False, AnyPropertyType,
+                           &type, &format, &nitems, &after, &data) == Success && data) {
+        if (type == XA_PIXMAP && format == 32 && nitems == 1)
+            pm = *(Pixmap *)data;
+        XFree(data);
+    }
+    return pm;
+}
+
+void kill_root_pixmap(Display *dpy, Window root_window) {
+    Pixmap pm = get_root_pixmap(dpy, root_window, esetroot_pmap_id);
+    if (pm != None) XKillClient(dpy, pm);
+    XDeleteProperty(dpy, root_window, esetroot_pmap_id);
+}
+
+int set_wallpaper(int screen) {
+    Visual *visual = DefaultVisual(display, screen);
+    int depth = DefaultDepth(display, screen);
+    if (visual->class != TrueColor || depth < 24) return 0;
+
+    char path[512];
+    if (wallpaper_path[0] == '~' && wallpaper_path[1] == '/')
+        snprintf(path, sizeof path, "%s%s", getenv("HOME"), wallpaper_path + 1);
+    else
+        snprintf(path, sizeof path, "%s", wallpaper_path);
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+
+    int w = DisplayWidth(display, screen);
+    int h = DisplayHeight(display, screen);
+    char cache_path[512];
+    wallpaper_cache_path(cache_path, sizeof cache_path, w, h);
+    WallpaperCacheHeader want = wallpaper_cache_header(path, &st, w, h, visual);
+
+    /* The pixmap lives on its own RetainPermanent connection so it survives
+     * reloads, and so setters following the Esetroot convention (feh,
+     * hsetroot) kill that connection rather than the window manager. */
+    Display *dpy = XOpenDisplay(DisplayString(display));
+    if (!dpy) return 0;
+    XSetCloseDownMode(dpy, RetainPermanent);
+    visual = DefaultVisual(dpy, screen);
+
+    Pixmap pm = None;
+    size_t map_size;
+    WallpaperCacheHeader *cached = map_wallpaper_cache(cache_path, &want, &map_size);
+    if (cached) {
+        pm = upload_wallpaper(dpy, (const uint32_t *)(cached + 1), w, h, visual, depth);
+        munmap(cached, map_size);
+    } else {
+        RGBImage img = { 0, 0, NULL };
+        uint32_t *pixels = NULL;
+        if (load_image(path, &img) && (pixels = malloc((size_t)w * h * 4)) &&
+            scale_image(&img, w, h, visual, pixels)) {
+            pm = upload_wallpaper(dpy, pixels, w, h, visual, depth);
+            write_wallpaper_cache(cache_path, &want, pixels);
+        }
+        free(pixels);
+        free(img.pixels);
+    }
+    if (pm == None) {
+        XSetCloseDownMode(dpy, DestroyAll);
+        XCloseDisplay(dpy);
+        return 0;
+    }
+
+    Window root_window = RootWindow(dpy, screen);
+    kill_root_pixmap(dpy, root_window);
+    XSetWindowBackgroundPixmap(dpy, root_window, pm);
+    XClearWindow(dpy, root_window);
+    XChangeProperty(dpy, root_window, xrootpmap_id, XA_PIXMAP, 32,
+                    PropModeReplace, (unsigned char *)&pm, 1);
+    XChangeProperty(dpy, root_window, esetroot_pmap_id, XA_PIXMAP, 32,
+                    PropModeReplace, (unsigned char *)&pm, 1);
+    XChangeProperty(dpy, root_window, twm_wallpaper_pmap, XA_PIXMAP, 32,
+                    PropModeReplace, (unsigned char *)&pm, 1);
+    XCloseDisplay(dpy);
+    return 1;
+}
+
 void set_background() {
     int screen = DefaultScreen(display);
     Window root_window = RootWindow(display, screen);
+    xrootpmap_id = XInternAtom(display, "_XROOTPMAP_ID", False);
+    esetroot_pmap_id = XInternAtom(display, "ESETROOT_PMAP_ID", False);
+    twm_wallpaper_pmap = XInternAtom(display, "_TWM_WALLPAPER_PMAP", False);
+    if (wallpaper_path && set_wallpaper(screen)) return;
     XSetWindowBackground(display, root_window, background_color);
     XClearWindow(display, root_window);
+    /* _TWM_WALLPAPER_PMAP remembers the pixmap an earlier run published, so
+     * it can be released after a reload. Leave the root properties alone
+     * unless they still point at it, so a wallpaper set by an autostart tool
+     * isn't clobbered. */
+    Pixmap owned = get_root_pixmap(display, root_window, twm_wallpaper_pmap);
+    if (owned == None) return;
+    if (get_root_pixmap(display, root_window, xrootpmap_id) == owned) {
+        XKillClient(display, owned);
+        XDeleteProperty(display, root_window, xrootpmap_id);
+        XDeleteProperty(display, root_window, esetroot_pmap_id);
+    }
+    XDeleteProperty(display, root_window, twm_wallpaper_pmap);
 }
 
 void spawn(const char *cmd) {
@@ -210,6 +841,13 @@ void toggle_floating(Window w) {
     if (!state->is_floating) {
         tile_windows();
     } else {
+        XWindowAttributes attr;
+        if (XGetWindowAttributes(display, w, &attr)) {
+            state->x = attr.x;
+            state->y = attr.y;
+            state->width = attr.width;
+            state->height = attr.height;
+        }
         XRaiseWindow(display, w);
     }
 }
@@ -293,21 +931,234 @@ void set_wm_desktop(Window w, int ws) {
                     PropModeReplace, (unsigned char *)&desktop, 1);
 }
 
+pid_t window_pid(Window w) {
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    unsigned char *data = NULL;
+    pid_t pid = -1;
+    if (XGetWindowProperty(display, w, net_wm_pid, 0, 1, False, XA_CARDINAL, &type, &format,
+                           &nitems, &after, &data) == Success && data) {
+        if (type == XA_CARDINAL && format == 32 && nitems == 1)
+            pid = (pid_t)*(unsigned long *)data;
+        XFree(data);
+    }
+    return pid;
+}
+
+pid_t spawn_scratchpad() {
+    char cmd[512];
+    snprintf(cmd, sizeof cmd, "exec %s", scratchpad_command);
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    setsid();
+    chdir(getenv("HOME"));
+    execlp("/bin/sh", "/bin/sh", "-c", cmd, NULL);
+    exit(1);
+}
+
+void refill_scratchpads() {
+    if (!scratchpad_command || scratchpad_failed) return;
+    int pooled = scratchpad_pending_count + scratchpad_handed_off;
+    for (int i = 0; i < window_count; i++)
+        if (window_states[i].managed && window_states[i].scratchpad == SCRATCHPAD_POOLED)
+            pooled++;
+    while (pooled < scratchpad_pool_size && scratchpad_pending_count < MAX_SCRATCHPADS) {
+        pid_t pid = spawn_scratchpad();
+        if (pid < 0) break;
+        scratchpad_pending[scratchpad_pending_count++] = pid;
+        pooled++;
+    }
+}
+
+int is_scratchpad_class(Window w) {
+    XClassHint hint = { NULL, NULL };
+    if (!XGetClassHint(display, w, &hint)) return 0;
+    int match = (hint.res_class && strcmp(hint.res_class, scratchpad_class) == 0) ||
+                (hint.res_name && strcmp(hint.res_name, scratchpad_class) == 0);
+    if (hint.res_class) XFree(hint.res_class);
+    if (hint.res_name) XFree(hint.res_name);
+    return match;
+}
+
+/* Takes over a window launched by refill_scratchpads() without mapping it. */
+int claim_scratchpad(Window w) {
+    if (scratchpad_pending_count == 0 && scratchpad_handed_off == 0) return 0;
+    int claimed = 0;
+    pid_t pid = window_pid(w);
+    for (int i = 0; i < scratchpad_pending_count && !claimed; i++) {
+        if (scratchpad_pending[i] != pid) continue;
+        scratchpad_pending[i] = scratchpad_pending[--scratchpad_pending_count];
+        claimed = 1;
+    }
+    /* Only stand in for a launcher that has already exited, so terminals of
+     * the same class started some other way aren't swallowed. */
+    if (!claimed && scratchpad_handed_off > 0 && scratchpad_class && is_scratchpad_class(w)) {
+        scratchpad_handed_off--;
+        claimed = 1;
+    }
+    if (!claimed) return 0;
+    windows[window_count] = w;
+    window_states[window_count] = (WindowState){ w, 0, 1, 0, 0, 0, 0, 0, 1, SCRATCHPAD_POOLED };
+    window_count++;
+    XSelectInput(display, w, EnterWindowMask | FocusChangeMask | PropertyChangeMask);
+    apply_window_border(w, False);
+    return 1;
+}
+
+void reap_children() {
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < scratchpad_pending_count; i++) {
+            if (scratchpad_pending[i] != pid) continue;
+            scratchpad_pending[i] = scratchpad_pending[--scratchpad_pending_count];
+            if (scratchpad_class && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                scratchpad_handed_off++;
+            } else {
+                /* Died before mapping a window; don't respawn it in a loop. */
+                scratchpad_failed = 1;
+            }
+            break;
+        }
+    }
+}
+
+int rule_matches(const Rule *rule, const XClassHint *hint, const char *title,
+                 const Atom *types, int ntypes) {
+    if (rule->class_name && (!hint->res_class || fnmatch(rule->class_name, hint->res_class, 0) != 0))
+        return 0;
+    if (rule->instance && (!hint->res_name || fnmatch(rule->instance, hint->res_name, 0) != 0))
+        return 0;
+    if (rule->title && (!title || fnmatch(rule->title, title, 0) != 0))
+        return 0;
+    if (rule->type != None) {
+        int found = 0;
+        for (int i = 0; i < ntypes && !found; i++) found = types[i] == rule->type;
+        if (!found) return 0;
+    }
+    return 1;
+}
+
+int get_window_types(Window w, Atom *types, int max) {
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    unsigned char *data = NULL;
+    int n = 0;
+    if (XGetWindowProperty(display, w, net_wm_window_type, 0, max, False, XA_ATOM, &type, &format,
+                           &nitems, &after, &data) == Success && data) {
+        if (type == XA_ATOM && format == 32)
+            for (unsigned long i = 0; i < nitems && n < max; i++)
+                types[n++] = ((Atom *)data)[i];
+        XFree(data);
+    }
+    return n;
+}
+
+void collect_rule_chain(const char *name, int on_class, int *candidates, int *n) {
+    if (!name) return;
+    for (int i = rule_hash[hash_string(name) % RULE_HASH_SIZE]; i >= 0; i = rules[i].next)
+        if (rules[i].hash_on_class == on_class)
+            candidates[(*n)++] = i;
+}
+
+/* Fills in workspace, floating, fullscreen and geometry from every matching
+ * rule, in config order, so later rules override earlier ones. */
+void apply_rules(Window w, WindowState *state) {
+    if (rule_count == 0) return;
+    XClassHint hint = { NULL, NULL };
+    XGetClassHint(display, w, &hint);
+    char *title = NULL;
+    if (rules_need_title) XFetchName(display, w, &title);
+    Atom types[MAX_WINDOW_TYPES];
+    int ntypes = rules_need_type ? get_window_types(w, types, MAX_WINDOW_TYPES) : 0;
+
+    int candidates[MAX_RULES];
+    int n = 0;
+    collect_rule_chain(hint.res_class, 1, candidates, &n);
+    collect_rule_chain(hint.res_name, 0, candidates, &n);
+    for (int i = 0; i < rule_fallback_count; i++) candidates[n++] = rule_fallback[i];
+    for (int i = 1; i < n; i++)
+        for (int j = i; j > 0 && candidates[j - 1] > candidates[j]; j--) {
+            int tmp = candidates[j];
+            candidates[j] = candidates[j - 1];
+            candidates[j - 1] = tmp;
+        }
+
+    int screen = DefaultScreen(display);
+    for (int i = 0; i < n; i++) {
+        const Rule *rule = &rules[candidates[i]];
+        if (!rule_matches(rule, &hint, title, types, ntypes)) continue;
+        if (rule->workspace) state->workspace = rule->workspace;
+        if (rule->floating) state->is_floating = 1;
+        if (rule->fullscreen) state->is_fullscreen = 1;
+        if (rule->has_geometry) {
+            state->width = rule->width;
+            state->height = rule->height;
+            state->x = rule->x_negative ? DisplayWidth(display, screen) + rule->x - rule->width : rule->x;
+            state->y = rule->y_negative ? DisplayHeight(display, screen) + rule->y - rule->height : rule->y;
+        }
+    }
+    if (hint.res_class) XFree(hint.res_class);
+    if (hint.res_name) XFree(hint.res_name);
+    if (title) XFree(title);
+}
+
 void add_window(Window w) {
-    if (window_count >= MAX_WINDOWS) return;
+    /* Pooled scratchpads stay unmapped, so their clients may ask again. */
+    if (idx_of_window(w) >= 0) return;
+    if (window_count >= MAX_WINDOWS) {
+        XMapWindow(display, w);
+        return;
+    }
+    if (claim_scratchpad(w)) return;
+    WindowState state = { w, 0, 0, 0, 0, 0, 0, current_workspace, 1, SCRATCHPAD_NONE };
+    apply_rules(w, &state);
+    int has_geometry = state.width != 0;
+    if ((state.is_floating || state.is_fullscreen) && !has_geometry) {
+        XWindowAttributes attr;
+        if (XGetWindowAttributes(display, w, &attr)) {
+            state.x = attr.x;
+            state.y = attr.y;
+            state.width = attr.width;
+            state.height = attr.height;
+        }
+    }
     windows[window_count] = w;
-    window_states[window_count] = (WindowState){ w, 0, 0, 0, 0, 0, 0, current_workspace, 1 };
+    window_states[window_count] = state;
     window_count++;
     XSelectInput(display, w, EnterWindowMask | FocusChangeMask | PropertyChangeMask);
     apply_window_border(w, False);
+    set_wm_desktop(w, state.workspace);
+
+    /* Configure into the final place before mapping so the window never
+     * shows up at its requested geometry first. */
+    int on_current = state.workspace == current_workspace;
+    if (state.is_fullscreen) {
+        int screen = DefaultScreen(display);
+        XMoveResizeWindow(display, w, 0, 0, DisplayWidth(display, screen), DisplayHeight(display, screen));
+    } else if (state.is_floating && has_geometry) {
+        XMoveResizeWindow(display, w, state.x, state.y, state.width, state.height);
+    }
+    if (!on_current) {
+        const int OFFSCREEN_X = -10000;
+        XMoveWindow(display, w, OFFSCREEN_X, state.y);
+    } else if (!state.is_floating && !state.is_fullscreen) {
+        tile_windows();
+    }
     XMapWindow(display, w);
-    set_wm_desktop(w, current_workspace);
-    tile_windows();
+    if (on_current && (state.is_floating || state.is_fullscreen)) XRaiseWindow(display, w);
+    if (!on_current || state.is_floating || state.is_fullscreen) {
+        last_bar_update = 0;
+        draw_bar();
+    }
 }
 
 void remove_window(Window w) {
     int idx = idx_of_window(w);
     if (idx < 0) return;
+    int was_scratchpad = window_states[idx].scratchpad;
     for (int j = idx; j < window_count - 1; j++) {
         windows[j] = windows[j + 1];
         window_states[j] = window_states[j + 1];
@@ -315,6 +1166,8 @@ void remove_window(Window w) {
     window_count--;
     if (focused == w) focused = None;
     if (last_focused[current_workspace] == w) last_focused[current_workspace] = None;
+    if (scratchpad_focus_pending == w) scratchpad_focus_pending = None;
+    if (was_scratchpad) refill_scratchpads();
     tile_windows();
 }
 
@@ -356,8 +1209,13 @@ void switch_workspace(int ws) {
     XChangeProperty(display, root, net_current_desktop, XA_CARDINAL, 32,
                     PropModeReplace, (unsigned char *)&desktop, 1);
     for (int i = 0; i < window_count; i++) {
-        if (!window_states[i].managed || window_states[i].workspace != current_workspace) continue;
-        XMapWindow(display, window_states[i].window);
+        WindowState *state = &window_states[i];
+        if (!state->managed || state->workspace != current_workspace) continue;
+        if (state->is_fullscreen)
+            XMoveWindow(display, state->window, 0, 0);
+        else if (state->is_floating)
+            XMoveWindow(display, state->window, state->x, state->y);
+        XMapWindow(display, state->window);
     }
     focused = last_focused[current_workspace];
     update_focus();
@@ -380,6 +1238,110 @@ void move_focused_to_workspace(int ws) {
     tile_windows();
 }
 
+void show_scratchpad(int i) {
+    WindowState *state = &window_states[i];
+    int was_pooled = state->scratchpad == SCRATCHPAD_POOLED;
+    int screen = DefaultScreen(display);
+    int screen_width = DisplayWidth(display, screen);
+    int screen_height = DisplayHeight(display, screen) - bar_height;
+    int w = scratchpad_width > 0 ? scratchpad_width : screen_width / 2;
+    int h = scratchpad_height > 0 ? scratchpad_height : screen_height / 2;
+    if (state->workspace > 0 && last_focused[state->workspace] == state->window)
+        last_focused[state->workspace] = None;
+    state->x = (screen_width - w) / 2;
+    state->y = bar_height + (screen_height - h) / 2;
+    state->width = w;
+    state->height = h;
+    state->is_floating = 1;
+    state->workspace = current_workspace;
+    state->scratchpad = SCRATCHPAD_IN_USE;
+    set_wm_desktop(state->window, current_workspace);
+    apply_window_border(state->window, True);
+    XMoveResizeWindow(display, state->window, state->x, state->y, w, h);
+    focused = state->window;
+    last_focused[current_workspace] = focused;
+    if (was_pooled) {
+        /* Not viewable until MapNotify, so focus it from there. */
+        XMapRaised(display, state->window);
+        scratchpad_focus_pending = state->window;
+        refill_scratchpads();
+    } else {
+        update_focus();
+    }
+}
+
+void hide_scratchpad(int i) {
+    WindowState *state = &window_states[i];
+    const int OFFSCREEN_X = -10000;
+    state->workspace = 0;
+    XMoveWindow(display, state->window, OFFSCREEN_X, state->y);
+    if (focused == state->window) focused = None;
+    if (last_focused[current_workspace] == state->window) last_focused[current_workspace] = None;
+    update_focus();
+}
+
+void toggle_scratchpad() {
+    int i = focused != None ? idx_of_window(focused) : -1;
+    if (i < 0 || window_states[i].scratchpad != SCRATCHPAD_IN_USE) {
+        for (i = window_count - 1; i >= 0; i--)
+            if (window_states[i].scratchpad == SCRATCHPAD_IN_USE && is_window_on_current_ws(&window_states[i]))
+                break;
+    }
+    if (i >= 0) {
+        hide_scratchpad(i);
+        return;
+    }
+    for (i = window_count - 1; i >= 0; i--)
+        if (window_states[i].scratchpad == SCRATCHPAD_IN_USE && !is_window_on_current_ws(&window_states[i]))
+            break;
+    if (i < 0) {
+        for (i = 0; i < window_count; i++)
+            if (window_states[i].scratchpad == SCRATCHPAD_POOLED)
+                break;
+    }
+    if (i >= 0 && i < window_count) {
+        show_scratchpad(i);
+    } else {
+        /* Pool is empty (or its command failed); try launching again. */
+        scratchpad_failed = 0;
+        refill_scratchpads();
+    }
+}
+
+/* Closes just this window; XKillClient() would also take down every other
+ * window of a single-instance terminal server. */
+void close_window(Window w) {
+    Atom *protocols;
+    int n;
+    int supported = 0;
+    if (XGetWMProtocols(display, w, &protocols, &n)) {
+        for (int i = 0; i < n && !supported; i++) supported = protocols[i] == wm_delete_window;
+        XFree(protocols);
+    }
+    if (!supported) {
+        XDestroyWindow(display, w);
+        return;
+    }
+    XEvent ev;
+    memset(&ev, 0, sizeof ev);
+    ev.xclient.type = ClientMessage;
+    ev.xclient.window = w;
+    ev.xclient.message_type = wm_protocols;
+    ev.xclient.format = 32;
+    ev.xclient.data.l[0] = wm_delete_window;
+    ev.xclient.data.l[1] = CurrentTime;
+    XSendEvent(display, w, False, NoEventMask, &ev);
+}
+
+void kill_scratchpad_pool() {
+    for (int i = 0; i < window_count; i++)
+        if (window_states[i].scratchpad == SCRATCHPAD_POOLED)
+            close_window(window_states[i].window);
+    for (int i = 0; i < scratchpad_pending_count; i++)
+        kill(scratchpad_pending[i], SIGTERM);
+    XSync(display, False);
+}
+
 void create_bar() {
     int screen = DefaultScreen(display);
     int screen_width = DisplayWidth(display, screen);
@@ -405,17 +1367,107 @@ void get_time_string(char *buf, size_t bufsz) {
     strftime(buf, bufsz, "%H:%M:%S", lt);
 }
 
-const char* get_layout_label() {
+int is_layout_symbol(const char *tok) {
+    static const char *skip[] = {
+        "pc", "inet", "group", "compose", "ctrl", "capslock", "level3", "level5",
+        "lv3", "lv5", "altwin", "terminate", "keypad", "kpdl", "nbsp", "shift",
+        "eurosign", "srvr_ctrl", "evdev", "aliases", NULL
+    };
+    size_t len = strcspn(tok, "(:");
+    if (len == 0 || !islower((unsigned char)tok[0])) return 0;
+    for (int i = 0; skip[i]; i++)
+        if (strlen(skip[i]) == len && strncmp(tok, skip[i], len) == 0)
+            return 0;
+    return 1;
+}
+
+void load_xkb_group_names() {
+    for (int i = 0; i < XkbNumKbdGroups; i++)
+        strcpy(xkb_group_labels[i], "??");
+
+    XkbDescPtr desc = XkbAllocKeyboard();
+    if (!desc) return;
+    if (XkbGetNames(display, XkbSymbolsNameMask | XkbGroupNamesMask, desc) != Success) {
+        XkbFreeKeyboard(desc, 0, True);
+        return;
+    }
+
+    /* Group names like "English (US)" are too long for the bar, so take the
+     * short layout codes out of the symbols name, e.g. "pc+us+ru:2+inet(evdev)". */
+    char *symbols = desc->names->symbols ? XGetAtomName(display, desc->names->symbols) : NULL;
+    if (symbols) {
+        int next_group = 0;
+        for (char *tok = strtok(symbols, "+"); tok; tok = strtok(NULL, "+")) {
+            if (!is_layout_symbol(tok)) continue;
+            char *colon = strchr(tok, ':');
+            int group = colon ? atoi(colon + 1) - 1 : next_group;
+            if (group < 0 || group >= XkbNumKbdGroups) continue;
+            size_t len = strcspn(tok, "(:");
+            if (len > sizeof(xkb_group_labels[0]) - 1) len = sizeof(xkb_group_labels[0]) - 1;
+            for (size_t j = 0; j < len; j++)
+                xkb_group_labels[group][j] = toupper((unsigned char)tok[j]);
+            xkb_group_labels[group][len] = '\0';
+            next_group = group + 1;
+        }
+        XFree(symbols);
+    } else {
+        for (int i = 0; i < XkbNumKbdGroups; i++) {
+            if (!desc->names->groups[i]) continue;
+            char *name = XGetAtomName(display, desc->names->groups[i]);
+            if (!name) continue;
+            snprintf(xkb_group_labels[i], sizeof(xkb_group_labels[i]), "%.2s", name);
+            for (char *c = xkb_group_labels[i]; *c; c++) *c = toupper((unsigned char)*c);
+            XFree(name);
+        }
+    }
+    XkbFreeKeyboard(desc, 0, True);
+}
+
+void init_xkb() {
+    int opcode, error_base, major = XkbMajorVersion, minor = XkbMinorVersion;
+    if (!XkbQueryExtension(display, &opcode, &xkb_event_base, &error_base, &major, &minor)) {
+        xkb_event_base = -1;
+        return;
+    }
+    XkbSelectEventDetails(display, XkbUseCoreKbd, XkbStateNotify,
+                          XkbAllStateComponentsMask, XkbGroupStateMask);
+    XkbSelectEventDetails(display, XkbUseCoreKbd, XkbNewKeyboardNotify,
+                          XkbAllNewKeyboardEventsMask, XkbAllNewKeyboardEventsMask);
+    XkbSelectEventDetails(display, XkbUseCoreKbd, XkbNamesNotify,
+                          XkbAllNamesMask, XkbSymbolsNameMask | XkbGroupNamesMask);
+    load_xkb_group_names();
     XkbStateRec state;
-    if (XkbGetState(display, XkbUseCoreKbd, &state) == Success) {
-        unsigned group = state.group;
-        switch (group) {
-            case 0: return "US";
-            case 1: return "RU";
-            default: return "??";
+    if (XkbGetState(display, XkbUseCoreKbd, &state) == Success)
+        xkb_group = state.group;
+}
+
+void handle_xkb_event(XkbEvent *ev) {
+    int group = xkb_group;
+    switch (ev->any.xkb_type) {
+        case XkbStateNotify:
+            group = ev->state.group;
+            break;
+        case XkbNewKeyboardNotify:
+        case XkbNamesNotify: {
+            load_xkb_group_names();
+            XkbStateRec state;
+            if (XkbGetState(display, XkbUseCoreKbd, &state) == Success)
+                group = state.group;
+            last_bar_update = 0;
+            break;
         }
     }
-    return "KB";
+    if (group != xkb_group) {
+        xkb_group = group;
+        last_bar_update = 0;
+    }
+    if (last_bar_update == 0) draw_bar();
+}
+
+const char* get_layout_label() {
+    if (xkb_event_base < 0) return "KB";
+    if (xkb_group < 0 || xkb_group >= XkbNumKbdGroups) return "??";
+    return xkb_group_labels[xkb_group];
 }
 
 int count_windows_on_ws(int ws) {
@@ -503,6 +1555,10 @@ void init_ewmh() {
     net_current_desktop = XInternAtom(display, "_NET_CURRENT_DESKTOP", False);
     net_wm_desktop = XInternAtom(display, "_NET_WM_DESKTOP", False);
     net_desktop_names = XInternAtom(display, "_NET_DESKTOP_NAMES", False);
+    net_wm_pid = XInternAtom(display, "_NET_WM_PID", False);
+    wm_protocols = XInternAtom(display, "WM_PROTOCOLS", False);
+    wm_delete_window = XInternAtom(display, "WM_DELETE_WINDOW", False);
+    net_wm_window_type = XInternAtom(display, "_NET_WM_WINDOW_TYPE", False);
 
     long num_desktops = MAX_WORKSPACES;
     XChangeProperty(display, root, net_number_of_desktops, XA_CARDINAL, 32,
@@ -541,7 +1597,10 @@ void handle_keybind(KeySym keysym, unsigned int state) {
             } else if (strncmp(cmd, "movews", 6) == 0) {
                 int ws = atoi(cmd + 6);
                 move_focused_to_workspace(ws);
+            } else if (strcmp(cmd, "scratchpad") == 0) {
+                toggle_scratchpad();
             } else if (strcmp(cmd, "reload") == 0) {
+                kill_scratchpad_pool();
                 execvp(saved_argv[0], saved_argv);
             } else {
                 spawn(cmd);
@@ -608,8 +1667,10 @@ int main(int argc, char *argv[]) {
     Cursor cursor = XCreateFontCursor(display, XC_left_ptr);
     XDefineCursor(display, root, cursor);
     create_bar();
+    init_xkb();
     init_ewmh();
     set_background();
+    refill_scratchpads();
     XSync(display, False);
 
     int xfd = ConnectionNumber(display);
@@ -619,10 +1680,15 @@ int main(int argc, char *argv[]) {
         FD_SET(xfd, &fds);
         struct timeval tv = {1, 0};
         int r = select(xfd + 1, &fds, NULL, NULL, &tv);
+        reap_children();
         if (r > 0) {
             while (XPending(display)) {
                 XEvent ev;
                 XNextEvent(display, &ev);
+                if (xkb_event_base >= 0 && ev.type == xkb_event_base) {
+                    handle_xkb_event((XkbEvent *)&ev);
+                    continue;
+                }
                 switch (ev.type) {
                     case Expose:
                         if (ev.xexpose.window == bar)
@@ -636,9 +1702,17 @@ int main(int argc, char *argv[]) {
                         handle_keybind(XkbKeycodeToKeysym(display, ev.xkey.keycode, 0, 0), ev.xkey.state);
                         break;
                     case MapRequest:
-                        XMapWindow(display, ev.xmaprequest.window);
                         add_window(ev.xmaprequest.window);
                         break;
+                    case MapNotify:
+                        if (ev.xmap.window == scratchpad_focus_pending) {
+                            scratchpad_focus_pending = None;
+                            update_focus();
+                        }
+                        break;
+                    case DestroyNotify:
+                        remove_window(ev.xdestroywindow.window);
+                        break;
                     case UnmapNotify:
                         remove_window(ev.xunmap.window);
                         break;
@@ -685,6 +1759,11 @@ int main(int argc, char *argv[]) {
                                     int dx = ev.xmotion.x_root - drag_start_x;
                                     int dy = ev.xmotion.y_root - drag_start_y;
                                     XMoveWindow(display, drag_window, attr.x + dx, attr.y + dy);
+                                    int i = idx_of_window(drag_window);
+                                    if (i >= 0) {
+                                        window_states[i].x = attr.x + dx;
+                                        window_states[i].y = attr.y + dy;
+                                    }
                                     drag_start_x = ev.xmotion.x_root;
                                     drag_start_y = ev.xmotion.y_root;
                                 } else if (resizing) {
@@ -694,6 +1773,11 @@ int main(int argc, char *argv[]) {
                                     int new_height = drag_start_height + dy;
                                     if (new_width > 100 && new_height > 100) {
                                         XResizeWindow(display, drag_window, new_width, new_height);
+                                        int i = idx_of_window(drag_window);
+                                        if (i >= 0) {
+                                            window_states[i].width = new_width;
+                                            window_states[i].height = new_height;
+                                        }
                                     }
                                 }
                             }
@@ -723,6 +1807,13 @@ int main(int argc, char *argv[]) {
         free(autostart_commands[i]);
     }
     free(wallpaper_path);
+    free(scratchpad_command);
+    free(scratchpad_class);
+    for (int i = 0; i < rule_count; i++) {
+        free(rules[i].class_name);
+        free(rules[i].instance);
+        free(rules[i].title);
+    }
     if (bar_font) XFreeFont(display, bar_font);
     if (bar_gc) XFreeGC(display, bar_gc);
     XCloseDisplay(display);